@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include "contain.h"
+
+static char *group;
+static int keeper = -1, parent = -1, procs = -1;
+
+char *findcgroup(pid_t pid) {
+  char *base, *path, *result;
+  struct stat st;
+
+  if (!(base = getcgroup(pid)))
+    return NULL;
+
+  /* A supervisor places its container in a contain-PID child cgroup,
+     whereas an init started by contain -m is already inside its own. */
+  path = string("%s/contain-%u", base, pid);
+  if (stat(path, &st) >= 0 && S_ISDIR(st.st_mode)) {
+    free(base);
+    return path;
+  }
+  free(path);
+
+  if ((result = strrchr(base, '/')) && !strncmp(result, "/contain-", 9))
+    return base;
+  free(base);
+  return NULL;
+}
+
+char *getcgroup(pid_t pid) {
+  char *line = NULL, *mount, *path, *result = NULL;
+  size_t size;
+  struct statfs fs;
+  FILE *file;
+
+  mount = "/sys/fs/cgroup";
+  if (statfs(mount, &fs) < 0 || fs.f_type != CGROUP2_SUPER_MAGIC) {
+    mount = "/sys/fs/cgroup/unified";
+    if (statfs(mount, &fs) < 0 || fs.f_type != CGROUP2_SUPER_MAGIC)
+      return NULL;
+  }
+
+  path = string("/proc/%u/cgroup", pid);
+  if ((file = fopen(path, "r"))) {
+    while (!result && getline(&line, &size, file) >= 0)
+      if (strncmp(line, "0::/", 4) == 0) {
+        line[strcspn(line, "\n")] = 0;
+        result = string("%s%s", mount, line[4] ? line + 3 : "");
+      }
+    fclose(file);
+  }
+
+  if (line)
+    free(line);
+  free(path);
+  return result;
+}
+
+void joincgroup(void) {
+  /* The container init has no use for the host cgroup directory, and
+     leaves removing the cgroup to the keeper. */
+  if (parent >= 0)
+    close(parent);
+  free(group);
+  group = NULL;
+  parent = -1;
+
+  if (procs >= 0 && write(procs, "0", 1) == 1) {
+#ifdef CLONE_NEWCGROUP
+    if (unshare(CLONE_NEWCGROUP) < 0)
+      errx(EXIT_FAILURE, "Failed to unshare cgroup namespace");
+#endif
+  }
+  if (procs >= 0)
+    close(procs);
+  procs = -1;
+
+  /* Only now init is in the cgroup may the keeper see it depopulated. */
+  if (keeper >= 0)
+    close(keeper);
+  keeper = -1;
+}
+
+static void keep(int fd, char *path) {
+  char byte;
+
+  /* Once every process holding the other end of the pipe has gone, wait
+     for the container to exit too, then remove its cgroup with the host
+     credentials it was created with, which the supervisor no longer has. */
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTERM, SIG_IGN);
+  dup2(fd, STDIN_FILENO);
+  syscall(__NR_close_range, 3, ~0U, 0);
+
+  while (read(STDIN_FILENO, &byte, 1) < 0)
+    if (errno != EINTR)
+      break;
+  waitcgroup(path, "populated 0");
+  rmdir(path);
+  _exit(EXIT_SUCCESS);
+}
+
+int makecgroup(unsigned uid, unsigned gid) {
+  char **file, *path;
+  int fd, fds[2];
+  static char *delegated[] = {
+    "", "cgroup.procs", "cgroup.subtree_control", "cgroup.threads", NULL
+  };
+
+  /* Paths in the host /sys/fs/cgroup are lost once the container pivots
+     into its new root, so everything here is done relative to a dirfd. */
+  if (!(path = getcgroup(getpid())))
+    return -1;
+  parent = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+  group = string("contain-%u", getpid());
+  if (parent < 0 || mkdirat(parent, group, 0755) < 0) {
+    if (parent >= 0)
+      close(parent);
+    free(group);
+    free(path);
+    group = NULL;
+    parent = -1;
+    return -1;
+  }
+
+  append(&path, "/%s", group);
+  if (pipe2(fds, O_CLOEXEC) < 0)
+    err(EXIT_FAILURE, "pipe2");
+  switch (fork()) {
+    case -1:
+      err(EXIT_FAILURE, "fork");
+    case 0:
+      close(fds[1]);
+      keep(fds[0], path);
+  }
+  close(fds[0]);
+  keeper = fds[1];
+  free(path);
+
+  /* Container root is given the files needed to manage its own subtree,
+     in the same way as a delegated cgroup under systemd. */
+  for (file = delegated; *file; file++) {
+    path = string("%s/%s", group, *file);
+    fchownat(parent, path, uid, gid, AT_SYMLINK_NOFOLLOW);
+    free(path);
+  }
+
+  path = string("%s/cgroup.procs", group);
+  procs = openat(parent, path, O_WRONLY | O_CLOEXEC);
+  free(path);
+
+  path = string("%s/cgroup.kill", group);
+  fd = openat(parent, path, O_WRONLY | O_CLOEXEC);
+  free(path);
+  return fd;
+}
+
+int setcgroup(char *file, char *value) {
+  char *path;
+  int fd, result = -1;
+
+  if (!group)
+    return -1;
+
+  path = string("%s/%s", group, file);
+  if ((fd = openat(parent, path, O_WRONLY | O_CLOEXEC)) >= 0) {
+    if (write(fd, value, strlen(value)) == (ssize_t) strlen(value))
+      result = 0;
+    close(fd);
+  }
+  free(path);
+  return result;
+}
+
+void waitcgroup(char *group, char *event) {
+  char *line = NULL, *path;
+  int fd, lines, match = 0;
+  size_t size;
+  struct pollfd fds[1];
+  FILE *file;
+
+  path = string("%s/cgroup.events", group);
+  if ((fd = open(path, O_RDONLY)) < 0 || !(file = fdopen(fd, "r")))
+    errx(EXIT_FAILURE, "Cannot read %s", path);
+
+  fds[0].fd = fd;
+  fds[0].events = POLLPRI;
+
+  /* A cgroup removed while we wait can no longer be read, but then it
+     has certainly been depopulated and thawed too. */
+  while (1) {
+    rewind(file);
+    for (lines = 0; getline(&line, &size, file) >= 0; lines++)
+      if (strncmp(line, event, strlen(event)) == 0)
+        if (strchr("\n", line[strlen(event)]))
+          match = 1;
+    if (match || lines == 0)
+      break;
+    if (poll(fds, 1, -1) < 0 && errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "poll");
+  }
+
+  fclose(file);
+  free(line);
+  free(path);
+}
+
+int writecgroup(char *group, char *file, char *value) {
+  char *path;
+  int fd, result = -1;
+
+  path = string("%s/%s", group, file);
+  if ((fd = open(path, O_WRONLY)) >= 0) {
+    if (write(fd, value, strlen(value)) == (ssize_t) strlen(value))
+      result = 0;
+    close(fd);
+  }
+  free(path);
+  return result;
+}
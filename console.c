@@ -3,20 +3,82 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <poll.h>
-#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <sys/signalfd.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "contain.h"
 
+#define BACKLOG 65536
+
+struct tag {
+  char *name;
+  int fresh;
+};
+
+static char *queue;
+static int paused, tagged;
+static size_t queued;
+static struct tag *tags;
 static struct termios saved;
 
+static void emit(char *data, size_t length) {
+  ssize_t count;
+
+  for (; length > 0; data += count, length -= count)
+    while ((count = write(STDOUT_FILENO, data, length)) < 0)
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "write");
+}
+
+static void display(int console, char *buffer, size_t length) {
+  char *end;
+  size_t size;
+  struct tag *tag;
+
+  if (console >= tagged || !tags[console].name) {
+    emit(buffer, length);
+    return;
+  }
+
+  /* Output from many consoles is interleaved on one stdout, so each line
+     is prefixed with the name of the container it came from. */
+  for (tag = tags + console; length > 0; buffer += size, length -= size) {
+    if (tag->fresh) {
+      emit(tag->name, strlen(tag->name));
+      emit(": ", 2);
+    }
+    end = memchr(buffer, '\n', length);
+    size = end ? end - buffer + 1 : length;
+    emit(buffer, size);
+    tag->fresh = end != NULL;
+  }
+}
+
+void closeconsole(int console, int slave) {
+  char buffer[PIPE_BUF];
+  ssize_t length;
+
+  unwatchfd(console);
+  close(slave);
+  fcntl(console, F_SETFL, fcntl(console, F_GETFL) & ~O_NONBLOCK);
+
+  while ((length = read(console, buffer, sizeof(buffer)))) {
+    if (length < 0 && errno != EAGAIN && errno != EINTR)
+      break;
+    if (length > 0)
+      display(console, buffer, length);
+  }
+  if (console < tagged)
+    tags[console].name = NULL;
+  close(console);
+}
+
 int getconsole(void) {
   int master, null;
 
@@ -87,89 +149,109 @@ void setconsole(char *name) {
         close(console);
 }
 
-int supervise(pid_t child, int console) {
+static void exited(pid_t child, int status, void *data) {
+  *(int *) data = status;
+  stoploop();
+}
+
+static void input(int fd, int events, void *data);
+static void output(int fd, int events, void *data);
+
+static void flush(int *console) {
+  ssize_t count;
+
+  while (queued > 0) {
+    if ((count = write(*console, queue, queued)) < 0) {
+      if (errno == EAGAIN)
+        break;
+      if (errno != EINTR)
+        err(EXIT_FAILURE, "write");
+      continue;
+    }
+    memmove(queue, queue + count, queued -= count);
+  }
+
+  if (paused && queued < BACKLOG) {
+    watchfd(STDIN_FILENO, EPOLLIN, input, console);
+    paused = 0;
+  }
+  watchfd(*console, queued ? EPOLLIN | EPOLLOUT : EPOLLIN, output, console);
+}
+
+static void input(int fd, int events, void *data) {
   char buffer[PIPE_BUF];
-  int signals, slave, status;
-  sigset_t mask;
-  ssize_t count, length, offset;
-  struct pollfd fds[3];
+  ssize_t length;
 
-  if (console < 0) {
-    if (waitpid(child, &status, 0) < 0)
-      err(EXIT_FAILURE, "waitpid");
-    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+  if ((length = read(fd, buffer, sizeof(buffer))) == 0)
+    unwatchfd(fd);
+  else if (length < 0 && errno != EAGAIN && errno != EINTR)
+    err(EXIT_FAILURE, "read");
+  if (length <= 0)
+    return;
+
+  /* A frozen or stalled container stops draining its console, so queue
+     input rather than blocking the supervisor, up to a sensible limit. */
+  if (!(queue = realloc(queue, queued + length)))
+    err(EXIT_FAILURE, "realloc");
+  memcpy(queue + queued, buffer, length);
+  queued += length;
+  if (queued >= BACKLOG) {
+    unwatchfd(fd);
+    paused = 1;
   }
+  flush(data);
+}
 
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGCHLD);
-  sigprocmask(SIG_BLOCK, &mask, NULL);
-  if ((signals = signalfd(-1, &mask, 0)) < 0)
-    err(EXIT_FAILURE, "signalfd");
+static void output(int fd, int events, void *data) {
+  char buffer[PIPE_BUF];
+  ssize_t length;
+
+  if (events & EPOLLOUT)
+    flush(data);
+
+  if (!(events & (EPOLLHUP | EPOLLIN)))
+    return;
+  if ((length = read(fd, buffer, sizeof(buffer))) < 0)
+    if (errno != EAGAIN && errno != EINTR && errno != EIO)
+      err(EXIT_FAILURE, "read");
+  if (length > 0)
+    display(fd, buffer, length);
+}
 
-  if (waitpid(child, &status, WNOHANG) > 0)
-    if (WIFEXITED(status) || WIFSIGNALED(status))
-      raise(SIGCHLD);
+int supervise(pid_t child, int console) {
+  int slave, status;
+
+  watchpid(child, exited, &status);
+  if (console < 0) {
+    runloop();
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+  }
 
   savemode();
   atexit(restoremode);
   rawmode();
 
   slave = open(ptsname(console), O_RDWR);
+  fcntl(console, F_SETFL, fcntl(console, F_GETFL) | O_NONBLOCK);
 
-  fds[0].fd = console;
-  fds[0].events = POLLIN;
-  fds[1].fd = STDIN_FILENO;
-  fds[1].events = POLLIN;
-  fds[2].fd = signals;
-  fds[2].events = POLLIN;
-
-  while (1) {
-    if (poll(fds, 3, -1) < 0)
-        if (errno != EAGAIN && errno != EINTR)
-          err(EXIT_FAILURE, "poll");
-
-    if (fds[0].revents & POLLIN) {
-      if ((length = read(console, buffer, sizeof(buffer))) < 0)
-        if (errno != EAGAIN && errno != EINTR)
-          err(EXIT_FAILURE, "read");
-      for (offset = 0; length > 0; offset += count, length -= count)
-        while ((count = write(STDOUT_FILENO, buffer + offset, length)) < 0)
-          if (errno != EAGAIN && errno != EINTR)
-            err(EXIT_FAILURE, "write");
-    }
-
-    if (fds[1].revents & (POLLHUP | POLLIN)) {
-      if ((length = read(STDIN_FILENO, buffer, sizeof(buffer))) == 0)
-        fds[1].events = 0;
-      else if (length < 0 && errno != EAGAIN && errno != EINTR)
-        err(EXIT_FAILURE, "read");
-      for (offset = 0; length > 0; offset += count, length -= count)
-        while ((count = write(console, buffer + offset, length)) < 0)
-          if (errno != EAGAIN && errno != EINTR)
-            err(EXIT_FAILURE, "write");
-    }
+  watchfd(console, EPOLLIN, output, &console);
+  watchfd(STDIN_FILENO, EPOLLIN, input, &console);
+  runloop();
 
-    if (fds[2].revents & POLLIN) {
-      if (read(signals, buffer, sizeof(buffer)) < 0)
-        if (errno != EAGAIN && errno != EINTR)
-          err(EXIT_FAILURE, "read");
-      if (waitpid(child, &status, WNOHANG) > 0)
-        if (WIFEXITED(status) || WIFSIGNALED(status))
-          break;
-    }
-  }
+  unwatchfd(STDIN_FILENO);
+  closeconsole(console, slave);
 
-  close(signals);
-  close(slave);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
 
-  while ((length = read(console, buffer, sizeof(buffer)))) {
-    if (length < 0 && errno != EAGAIN && errno != EINTR)
-      break;
-    for (offset = 0; length > 0; offset += count, length -= count)
-      while ((count = write(STDOUT_FILENO, buffer + offset, length)) < 0)
-        if (errno != EAGAIN && errno != EINTR)
-          err(EXIT_FAILURE, "write");
+void watchconsole(int console, char *name) {
+  if (console >= tagged) {
+    if (!(tags = realloc(tags, (console + 1) * sizeof(*tags))))
+      err(EXIT_FAILURE, "realloc");
+    memset(tags + tagged, 0, (console + 1 - tagged) * sizeof(*tags));
+    tagged = console + 1;
   }
-
-  return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+  tags[console].name = name;
+  tags[console].fresh = 1;
+  watchfd(console, EPOLLIN, output, NULL);
 }
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdio.h>
@@ -11,72 +12,127 @@
 #include <sysexits.h>
 #include <unistd.h>
 #include <linux/sched.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include "contain.h"
 
+#define REQUEST_MAX 65536
+
+struct container {
+  char *dir;
+  int console, control, killer, slave;
+  pid_t init;
+  struct container *next;
+};
+
+static char *gidmap, *inside, *outside, *uidmap;
+static int dying, hostnet, killer = -1, launcher = -1, netns = -1, reading;
+static int reaper, stdio, veth;
+static struct container *containers;
+static pid_t orphan, pod;
+
 static void usage(const char *progname) {
   fprintf(stderr, "\
 Usage: %s [OPTIONS] DIR [CMD [ARG]...]\n\
+       %s -m [OPTIONS] <LIST\n\
 Options:\n\
+  -a CPUS   pin the container to CPUS[:NODES], with memory on NUMA NODES\n\
+  -b BIND   bind a host file or directory into the container\n\
   -c        disable console emulation in the container\n\
+  -d DEVICE bind an extra host device node such as /dev/fuse into /dev\n\
   -g MAP    set the container-to-host GID map\n\
   -i CMD    run a helper child inside the new namespaces\n\
+  -j PATH   join the persistent network namespace bound at PATH\n\
+  -m        supervise a container for each DIR [CMD [ARG]...] line of LIST\n\
   -n        share the host network unprivileged in the container\n\
   -o CMD    run a helper child outside the new namespaces\n\
+  -p PORT   forward a host port into the container network namespace\n\
+  -q CLASS  schedule the container as a latency, batch or idle workload\n\
+  -r        run a minimal init as PID 1 to reap zombies and forward signals\n\
+  -s OPTS   set tmpfs mount options such as size= for /dev/shm\n\
+  -t PAGES  bind the host hugetlbfs with PAGES size or path at /dev/hugepages\n\
   -u MAP    set the container-to-host UID map\n\
+  -v SPEC   create a veth pair linking the container to the host network\n\
+  -w PID    join the network, IPC and UTS namespaces of container PID\n\
+Bind mounts are specified as SRC:DST[:ro] with DST inside the container.\n\
 GID and UID maps are specified as START:LOWER:COUNT[,START:LOWER:COUNT]...\n\
-", progname);
+Forwarded ports are specified as [tcp:|udp:]HOSTPORT[:PORT] and veth pairs\n\
+are specified as KEY=VALUE[,KEY=VALUE]... with keys address, gateway,\n\
+host, mtu, name and peer\n\
+", progname, progname);
   exit(EX_USAGE);
 }
 
-int main(int argc, char **argv) {
-  char *gidmap = NULL, *inside = NULL, *outside = NULL, *uidmap = NULL;
-  int hostnet = 0, master, option, stdio = 0;
-  pid_t child, parent;
+static void guardhelper(int fd) {
+  char byte;
+  pid_t group = getpid();
+  ssize_t count;
 
-  while ((option = getopt(argc, argv, "+:cg:i:no:u:")) > 0)
-    switch (option) {
-      case 'c':
-        stdio++;
-        break;
-      case 'g':
-        gidmap = optarg;
-        break;
-      case 'i':
-        inside = optarg;
-        break;
-      case 'n':
-        hostnet++;
-        break;
-      case 'o':
-        outside = optarg;
-        break;
-      case 'u':
-        uidmap = optarg;
-        break;
-      default:
-        usage(argv[0]);
-    }
+  switch (fork()) {
+    case -1:
+      err(EXIT_FAILURE, "fork");
+    case 0:
+      do
+        count = read(fd, &byte, 1);
+      while (count < 0 && errno == EINTR);
+      if (count <= 0)
+        kill(-group, SIGKILL);
+      _exit(EXIT_SUCCESS);
+  }
+  close(fd);
+}
 
-  if (argc <= optind)
-    usage(argv[0]);
+static pid_t launch(char *dir, char **argv, int *console) {
+  int guard[2];
+  pid_t child, parent;
+  unsigned gid = INVALID, uid = INVALID;
 
   parent = getpid();
+  tuneprocess();
+
+  if (!pod) {
+    gid = getroot(GID, gidmap);
+    uid = getroot(UID, uidmap);
+  }
+
+  if (outside && pipe2(guard, O_CLOEXEC) < 0)
+    err(EXIT_FAILURE, "pipe2");
+
   switch (child = fork()) {
     case -1:
       err(EXIT_FAILURE, "fork");
     case 0:
+      /* Don't linger stopped if the parent fails before continuing us. */
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() != parent)
+        exit(EXIT_FAILURE);
       raise(SIGSTOP);
-      if (geteuid() != 0)
-        denysetgroups(parent);
-      writemap(parent, GID, gidmap);
-      writemap(parent, UID, uidmap);
+      if (!pod) {
+        if (geteuid() != 0)
+          denysetgroups(parent);
+        writemap(parent, GID, gidmap);
+        writemap(parent, UID, uidmap);
+      }
 
-      if (outside) {
+      if (outside || veth) {
         if (setgid(getgid()) < 0 || setuid(getuid()) < 0)
           errx(EXIT_FAILURE, "Failed to drop privileges");
+        makeveth(parent);
+      }
+
+      /* Having dropped privilege, the helper no longer gets PR_SET_PDEATHSIG
+         and the supervisor can't kill it once it is container root, so a
+         watchdog with the same credentials kills its process group if the
+         supervisor exits without confirming the helper has finished. */
+      if (outside) {
+        close(guard[1]);
+        setpgid(0, 0);
+        guardhelper(guard[0]);
+        raise(SIGSTOP);
         prctl(PR_SET_DUMPABLE, 1);
         execlp(SHELL, SHELL, "-c", outside, NULL);
         err(EXIT_FAILURE, "exec %s", outside);
@@ -85,22 +141,41 @@ int main(int argc, char **argv) {
       exit(EXIT_SUCCESS);
   }
 
+  if (outside)
+    close(guard[0]);
+
+  if (netns >= 0 && setns(netns, CLONE_NEWNET) < 0)
+    errx(EXIT_FAILURE, "Failed to join network namespace");
+
   if (setgid(getgid()) < 0 || setuid(getuid()) < 0)
     errx(EXIT_FAILURE, "Failed to drop privileges");
   prctl(PR_SET_DUMPABLE, 1);
 
-  if (unshare(CLONE_NEWUSER) < 0)
-    errx(EXIT_FAILURE, "Failed to unshare user namespace");
+  /* The container cgroup is created and tuned with the credentials of the
+     invoking user, which are lost on entering the new user namespace, and
+     then delegated to container root. */
+  killer = makecgroup(uid, gid);
+  tunecgroup();
 
-#ifdef CLONE_NEWCGROUP
-  if (unshare(CLONE_NEWCGROUP) < 0)
-    errx(EXIT_FAILURE, "Failed to unshare cgroup namespace");
-#endif
+  /* A pod member joins the user, IPC, network and UTS namespaces of an
+     existing container, with the credentials of the invoking user so that
+     it can only join containers of its own. */
+  if (pod) {
+    join(pod, "user");
+    setgid(0);
+    setgroups(0, NULL);
+    setuid(0);
+    if (join(pod, "ipc") < 0 || join(pod, "net") < 0 || join(pod, "uts") < 0)
+      errx(EXIT_FAILURE, "Failed to join namespaces of PID %u", pod);
+  }
+
+  if (!pod && unshare(CLONE_NEWUSER) < 0)
+    errx(EXIT_FAILURE, "Failed to unshare user namespace");
 
-  if (unshare(CLONE_NEWIPC) < 0)
+  if (!pod && unshare(CLONE_NEWIPC) < 0)
     errx(EXIT_FAILURE, "Failed to unshare IPC namespace");
 
-  if (!hostnet && unshare(CLONE_NEWNET) < 0)
+  if (!hostnet && netns < 0 && !pod && unshare(CLONE_NEWNET) < 0)
     errx(EXIT_FAILURE, "Failed to unshare network namespace");
 
   if (unshare(CLONE_NEWNS) < 0)
@@ -111,19 +186,43 @@ int main(int argc, char **argv) {
     errx(EXIT_FAILURE, "Failed to unshare time namespace");
 #endif
 
-  if (unshare(CLONE_NEWUTS) < 0)
+  if (!pod && unshare(CLONE_NEWUTS) < 0)
     errx(EXIT_FAILURE, "Failed to unshare UTS namespace");
 
   waitforstop(child);
   kill(child, SIGCONT);
-  waitforexit(child);
+
+  /* Once the maps are written, an outside helper stops again and is left
+     to run alongside construction of the root filesystem, only holding
+     back the start of init until it has finished. */
+  if (outside) {
+    waitforstop(child);
+    kill(child, SIGCONT);
+  } else {
+    waitforexit(child);
+  }
 
   setgid(0);
   setgroups(0, NULL);
   setuid(0);
 
-  master = stdio ? -1 : getconsole();
-  createroot(argv[optind], master, inside);
+  if (!hostnet && netns < 0 && !pod)
+    startnet();
+
+#ifdef CLONE_NEWCGROUP
+  if (unshare(CLONE_NEWCGROUP) < 0)
+    errx(EXIT_FAILURE, "Failed to unshare cgroup namespace");
+#endif
+
+  *console = stdio ? -1 : getconsole();
+  createroot(dir, *console, inside);
+
+  if (outside) {
+    waitforexit(child);
+    if (write(guard[1], "", 1) != 1)
+      err(EXIT_FAILURE, "write");
+    close(guard[1]);
+  }
 
   if (unshare(CLONE_NEWPID) < 0)
     errx(EXIT_FAILURE, "Failed to unshare PID namespace");
@@ -132,25 +231,409 @@ int main(int argc, char **argv) {
     case -1:
       err(EXIT_FAILURE, "fork");
     case 0:
+      joincgroup();
       mountproc();
-      if (!hostnet)
+      if (!hostnet && netns < 0)
         mountsys();
       enterroot();
 
-      if (master >= 0) {
-        close(master);
+      if (*console >= 0) {
+        close(*console);
         setconsole("/dev/console");
       }
 
       clearenv();
       putenv("container=contain");
 
-      if (argv[optind + 1])
-        execv(argv[optind + 1], argv + optind + 1);
+      if (reaper)
+        runinit();
+
+      if (argv[0])
+        execv(argv[0], argv);
       else
         execl(SHELL, SHELL, NULL);
       err(EXIT_FAILURE, "exec");
   }
 
-  return supervise(child, master);
+  return child;
+}
+
+static void discard(struct container *container) {
+  struct container **link;
+
+  for (link = &containers; *link; link = &(*link)->next)
+    if (*link == container) {
+      *link = container->next;
+      break;
+    }
+
+  if (container->control >= 0) {
+    unwatchfd(container->control);
+    close(container->control);
+  }
+  if (container->killer >= 0)
+    close(container->killer);
+  free(container->dir);
+  free(container);
+
+  if (!containers && !reading)
+    stoploop();
+}
+
+static void finished(pid_t pid, int status, void *data) {
+  struct container *container = data;
+
+  if (container->console >= 0)
+    closeconsole(container->console, container->slave);
+  if (WIFEXITED(status))
+    warnx("%s: PID %d exited with status %d", container->dir, pid,
+      WEXITSTATUS(status));
+  else
+    warnx("%s: PID %d killed by signal %d", container->dir, pid,
+      WTERMSIG(status));
+  discard(container);
+}
+
+static void slay(pid_t init, int fd) {
+  if (fd < 0 || write(fd, "1", 1) < 0)
+    kill(init, SIGKILL);
+}
+
+static void started(struct container *container) {
+  warnx("%s: started as PID %d", container->dir, container->init);
+  if (container->console >= 0)
+    watchconsole(container->console, container->dir);
+  watchpid(container->init, finished, container);
+  if (dying)
+    slay(container->init, container->killer);
+}
+
+static void launched(int fd, int events, void *data) {
+  struct container *container = data;
+  int fds[3];
+  pid_t init;
+
+  /* The launcher child reports the PID of init, which is watched from
+     here, before the launcher child exits and leaves it to be adopted by
+     this subreaper, so it is never mistaken for an orphan. */
+  if (recvfds(fd, &init, sizeof(init), fds, 3) == sizeof(init)) {
+    container->init = init;
+    if (stdio) {
+      container->killer = fds[0];
+    } else {
+      container->console = fds[0];
+      container->slave = fds[1];
+      container->killer = fds[2];
+    }
+    started(container);
+    return;
+  }
+
+  unwatchfd(fd);
+  close(fd);
+  container->control = -1;
+  if (container->init < 0) {
+    warnx("%s: failed to start", container->dir);
+    discard(container);
+  }
+}
+
+static char **split(char *line) {
+  char **argv = NULL, *word;
+  size_t count = 0;
+
+  for (word = strtok(line, " \t"); word; word = strtok(NULL, " \t")) {
+    if (count == 0 && *word == '#')
+      break;
+    if (!(argv = realloc(argv, (count + 2) * sizeof(char *))))
+      err(EXIT_FAILURE, "realloc");
+    argv[count++] = word;
+    argv[count] = NULL;
+  }
+  return argv;
+}
+
+static void spawn(char *line) {
+  char **argv, *copy;
+  int sockets[2];
+  struct container *container;
+
+  if (!(copy = strdup(line)))
+    err(EXIT_FAILURE, "strdup");
+  if (!(argv = split(copy))) {
+    free(copy);
+    return;
+  }
+
+  if (!(container = calloc(1, sizeof(*container))))
+    err(EXIT_FAILURE, "calloc");
+  if (!(container->dir = strdup(argv[0])))
+    err(EXIT_FAILURE, "strdup");
+  container->console = container->control = -1;
+  container->killer = container->slave = -1;
+  container->init = -1;
+  container->next = containers;
+  containers = container;
+  free(argv);
+  free(copy);
+
+  if (strlen(line) >= REQUEST_MAX) {
+    warnx("%s: request is too long", container->dir);
+    discard(container);
+    return;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) < 0)
+    err(EXIT_FAILURE, "socketpair");
+  if (sendfds(launcher, line, strlen(line) + 1, sockets + 1, 1) < 0) {
+    warn("%s: failed to send request to launcher", container->dir);
+    close(sockets[0]);
+    close(sockets[1]);
+    discard(container);
+    return;
+  }
+
+  close(sockets[1]);
+  container->control = sockets[0];
+  watchfd(sockets[0], EPOLLIN, launched, container);
+}
+
+static void abandon(void) {
+  if (orphan > 0)
+    slay(orphan, killer);
+}
+
+static void delegate(int sock) {
+  char **argv, line[REQUEST_MAX];
+  int console, control, fds[3], null, passed = 0;
+  ssize_t length;
+
+  /* This process keeps setuid privilege on behalf of the supervisor, but
+     only ever forks a child to launch each container it is asked for. */
+  signal(SIGCHLD, SIG_IGN);
+  if ((null = open("/dev/null", O_RDONLY)) >= 0)
+    dup2(null, STDIN_FILENO);
+
+  while ((length = recvfds(sock, line, sizeof(line) - 1, &control, 1)) > 0) {
+    if (control < 0)
+      continue;
+    line[length] = 0;
+
+    switch (fork()) {
+      case -1:
+        warn("fork");
+        break;
+      case 0:
+        close(sock);
+        signal(SIGCHLD, SIG_DFL);
+        if (!(argv = split(line)))
+          _exit(EXIT_FAILURE);
+
+        orphan = launch(argv[0], argv + 1, &console);
+        atexit(abandon);
+
+        if (console >= 0) {
+          fds[passed++] = console;
+          if ((fds[passed++] = open(ptsname(console), O_RDWR)) < 0)
+            errx(EXIT_FAILURE, "Failed to open console pseudo-terminal");
+        }
+        if (killer >= 0)
+          fds[passed++] = killer;
+        if (sendfds(control, &orphan, sizeof(orphan), fds, passed) < 0)
+          err(EXIT_FAILURE, "sendmsg");
+        _exit(EXIT_SUCCESS);
+    }
+    close(control);
+  }
+  exit(EXIT_SUCCESS);
+}
+
+static void request(int fd, int events, void *data) {
+  char buffer[PIPE_BUF], *end, *line;
+  static char *list;
+  ssize_t length;
+
+  if ((length = read(fd, buffer, sizeof(buffer))) < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "read");
+    return;
+  }
+
+  if (length > 0) {
+    append(&list, "%.*s", (int) length, buffer);
+    for (line = list; (end = strchr(line, '\n')); line = end + 1) {
+      *end = 0;
+      spawn(line);
+    }
+    memmove(list, line, strlen(line) + 1);
+    return;
+  }
+
+  if (list)
+    spawn(list);
+  free(list);
+  list = NULL;
+
+  unwatchfd(fd);
+  close(launcher);
+  reading = 0;
+  if (!containers)
+    stoploop();
+}
+
+static void terminate(int signal, void *data) {
+  struct container *container;
+
+  if (!data) {
+    if (reading) {
+      unwatchfd(STDIN_FILENO);
+      close(launcher);
+    }
+    reading = 0, dying = 1;
+    for (container = containers; container; container = container->next)
+      if (container->init > 0)
+        slay(container->init, container->killer);
+    if (!containers)
+      stoploop();
+  } else {
+    slay(*(pid_t *) data, killer);
+  }
+}
+
+int main(int argc, char **argv) {
+  char *end, *netpath = NULL;
+  int console, forwarding = 0, multiple = 0, option, sockets[2];
+  pid_t child;
+  uid_t uid;
+
+  while ((option = getopt(argc, argv, "+:a:b:cd:g:i:j:mno:p:q:rs:t:u:v:w:")) > 0)
+    switch (option) {
+      case 'a':
+        setaffinity(optarg);
+        break;
+      case 'b':
+        setbind(optarg);
+        break;
+      case 'c':
+        stdio++;
+        break;
+      case 'd':
+        setdevice(optarg);
+        break;
+      case 'g':
+        gidmap = optarg;
+        break;
+      case 'i':
+        inside = optarg;
+        break;
+      case 'j':
+        netpath = optarg;
+        break;
+      case 'm':
+        multiple++;
+        break;
+      case 'n':
+        hostnet++;
+        break;
+      case 'o':
+        outside = optarg;
+        break;
+      case 'p':
+        setforward(optarg);
+        forwarding++;
+        break;
+      case 'q':
+        setclass(optarg);
+        break;
+      case 'r':
+        reaper++;
+        break;
+      case 's':
+        setshm(optarg);
+        break;
+      case 't':
+        sethugepages(optarg);
+        break;
+      case 'u':
+        uidmap = optarg;
+        break;
+      case 'v':
+        setveth(optarg);
+        veth++;
+        break;
+      case 'w':
+        pod = strtol(optarg, &end, 10);
+        if (end == optarg || *end || pod <= 0)
+          usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+
+  if (multiple ? argc > optind : argc <= optind)
+    usage(argv[0]);
+  if (!!hostnet + !!netpath + !!pod > 1)
+    errx(EXIT_FAILURE, "Only one of -j, -n and -w can be used");
+  if ((hostnet || netpath || pod) && veth)
+    errx(EXIT_FAILURE, "Cannot create a veth pair in a shared network");
+  if (pod && (gidmap || uidmap))
+    errx(EXIT_FAILURE, "Cannot set UID or GID maps in a shared user namespace");
+  if (forwarding && (hostnet || multiple))
+    errx(EXIT_FAILURE, "Cannot forward ports with -%c", hostnet ? 'n' : 'm');
+
+  /* Open the network namespace and bind forwarded ports in the host
+     namespace with the invoking user's credentials, so that the usual
+     permissions apply. The namespace is joined privileged in launch(), so
+     opennetns() also checks that it belongs to the invoking user. */
+  uid = geteuid();
+  if (seteuid(getuid()) < 0)
+    errx(EXIT_FAILURE, "Failed to drop privileges");
+  if (netpath)
+    netns = opennetns(netpath);
+  openforwards();
+  if (seteuid(uid) < 0)
+    errx(EXIT_FAILURE, "Failed to restore privileges");
+
+  if (!multiple) {
+    child = launch(argv[optind], argv + optind + 1, &console);
+    watchsignal(SIGTERM, terminate, &child);
+
+    /* Relaying into a TCP socket whose peer has gone raises SIGPIPE. This
+       is only ignored now init has been forked, so it doesn't inherit it. */
+    if (forwarding)
+      signal(SIGPIPE, SIG_IGN);
+    return supervise(child, console);
+  }
+
+  /* Setuid privilege is kept only by a launcher process which sets up each
+     container on request, so the long-lived supervisor can drop it for
+     good before it reads any input or container output. */
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+    err(EXIT_FAILURE, "prctl PR_SET_CHILD_SUBREAPER");
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) < 0)
+    err(EXIT_FAILURE, "socketpair");
+
+  switch (child = fork()) {
+    case -1:
+      err(EXIT_FAILURE, "fork");
+    case 0:
+      close(sockets[0]);
+      delegate(sockets[1]);
+  }
+
+  close(sockets[1]);
+  launcher = sockets[0];
+  if (setgid(getgid()) < 0 || setuid(getuid()) < 0)
+    errx(EXIT_FAILURE, "Failed to drop privileges");
+  prctl(PR_SET_DUMPABLE, 1);
+
+  reading = 1;
+  reaporphans();
+  watchsignal(SIGTERM, terminate, NULL);
+  watchfd(STDIN_FILENO, EPOLLIN, request, NULL);
+  runloop();
+
+  /* The launcher exits once its socket has been closed. */
+  waitpid(child, NULL, 0);
+  return EXIT_SUCCESS;
 }
@@ -12,19 +12,55 @@
 #define subpath(type) ((type) == GID ? "/etc/subgid" : "/etc/subuid")
 
 char *append(char **destination, const char *format, ...);
+void closeconsole(int console, int slave);
 void createroot(char *src, int console, char *helper);
 void denysetgroups(pid_t pid);
 void enterroot(void);
+char *findcgroup(pid_t pid);
+char *getcgroup(pid_t pid);
 int getconsole(void);
+unsigned getroot(int type, char *map);
+int join(pid_t pid, char *type);
+void joincgroup(void);
+int makecgroup(unsigned uid, unsigned gid);
+void makeveth(pid_t pid);
 void mountproc(void);
 void mountsys(void);
+void openforwards(void);
+int opennetns(char *path);
+ssize_t recvfds(int sock, void *data, size_t size, int *fds, int count);
+void reaporphans(void);
+void runinit(void);
+void runloop(void);
 void seal(char **argv, char **envp);
+int sendfds(int sock, void *data, size_t size, int *fds, int count);
+void setaffinity(char *spec);
+void setbind(char *spec);
+int setcgroup(char *file, char *value);
+void setclass(char *name);
 void setconsole(char *name);
+void setdevice(char *spec);
+void setforward(char *spec);
+void sethugepages(char *spec);
+void setshm(char *options);
+void setveth(char *spec);
+void startnet(void);
+void stoploop(void);
 char *string(const char *format, ...);
 int supervise(pid_t child, int console);
 char *tmpdir(void);
+void tunecgroup(void);
+void tuneprocess(void);
+void unwatchfd(int fd);
+void waitcgroup(char *group, char *event);
 void waitforstop(pid_t child);
 void waitforexit(pid_t child);
+void watchconsole(int console, char *name);
+void watchfd(int fd, int events, void (*handler)(int, int, void *),
+    void *data);
+void watchpid(pid_t pid, void (*handler)(pid_t, int, void *), void *data);
+void watchsignal(int signal, void (*handler)(int, void *), void *data);
+int writecgroup(char *group, char *file, char *value);
 void writemap(pid_t pid, int type, char *map);
 
 #endif
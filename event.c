@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "contain.h"
+
+struct watch {
+  void (*handler)(int fd, int events, void *data);
+  void *data;
+  int ready;
+  uint32_t generation;
+};
+
+struct child {
+  pid_t pid;
+  void (*handler)(pid_t pid, int status, void *data);
+  void *data;
+  struct child *next;
+};
+
+static struct child *waiting;
+static struct watch *watches;
+static int epoll = -1, orphans, ready, running, signals = -1, size;
+static uint32_t generation;
+static sigset_t mask;
+static void (*handlers[NSIG])(int signal, void *data);
+static void *contexts[NSIG];
+
+static void reap(int fd, int events, void *data);
+
+static int tracked(pid_t pid) {
+  struct child *child;
+  int fd;
+
+  for (child = waiting; child; child = child->next)
+    if (child->pid == pid)
+      return 1;
+  for (fd = 0; fd < size; fd++)
+    if (watches[fd].handler == reap)
+      if (((struct child *) watches[fd].data)->pid == pid)
+        return 1;
+  return 0;
+}
+
+static void adopt(void) {
+  siginfo_t info;
+
+  /* A subreaper inherits descendants orphaned by their parents as well as
+     the children it watches, so reap those as they exit. Only the first
+     zombie can be examined without reaping it, so stop at a watched one
+     until its own handler has dealt with it. */
+  while (orphans) {
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0)
+      break;
+    if (info.si_pid == 0 || tracked(info.si_pid))
+      break;
+    waitpid(info.si_pid, NULL, WNOHANG);
+  }
+}
+
+static void reap(int fd, int events, void *data) {
+  struct child *child = data;
+  int status;
+
+  if (waitpid(child->pid, &status, WNOHANG) <= 0)
+    return;
+  unwatchfd(fd);
+  close(fd);
+  child->handler(child->pid, status, child->data);
+  free(child);
+  adopt();
+}
+
+static void sweep(int signal, void *data) {
+  struct child *child, **link;
+  int status;
+
+  for (link = &waiting; (child = *link); )
+    if (waitpid(child->pid, &status, WNOHANG) > 0) {
+      *link = child->next;
+      child->handler(child->pid, status, child->data);
+      free(child);
+    } else {
+      link = &child->next;
+    }
+  adopt();
+}
+
+static void deliver(int fd, int events, void *data) {
+  struct signalfd_siginfo info;
+
+  if (read(fd, &info, sizeof(info)) != sizeof(info)) {
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "read");
+    return;
+  }
+  if (info.ssi_signo < NSIG && handlers[info.ssi_signo])
+    handlers[info.ssi_signo](info.ssi_signo, contexts[info.ssi_signo]);
+}
+
+void reaporphans(void) {
+  orphans = 1;
+  watchsignal(SIGCHLD, sweep, NULL);
+}
+
+void runloop(void) {
+  struct epoll_event events[64];
+  int count, fd, index;
+  uint32_t tag;
+
+  for (running = 1; running; ) {
+    count = epoll_wait(epoll, events, 64, ready ? 0 : -1);
+    if (count < 0 && errno != EINTR)
+      err(EXIT_FAILURE, "epoll_wait");
+
+    /* Events carry the generation of the watch as well as its fd, so an
+       event for an fd closed and reused earlier in the batch is dropped. */
+    for (index = 0; running && index < count; index++) {
+      fd = events[index].data.u64 & UINT32_MAX;
+      tag = events[index].data.u64 >> 32;
+      if (fd < size && watches[fd].handler && watches[fd].generation == tag)
+        watches[fd].handler(fd, events[index].events, watches[fd].data);
+    }
+
+    /* Files and some devices cannot be polled but are always ready. */
+    for (fd = 0; running && ready && fd < size; fd++)
+      if (watches[fd].handler && watches[fd].ready)
+        watches[fd].handler(fd, EPOLLIN | EPOLLOUT, watches[fd].data);
+  }
+}
+
+void stoploop(void) {
+  running = 0;
+}
+
+void unwatchfd(int fd) {
+  if (fd >= size || !watches[fd].handler)
+    return;
+  if (watches[fd].ready)
+    ready--;
+  else
+    epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+  watches[fd].handler = NULL;
+  watches[fd].ready = 0;
+}
+
+void watchfd(int fd, int events, void (*handler)(int, int, void *),
+    void *data) {
+  struct epoll_event event = { .events = events };
+
+  if (epoll < 0 && (epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "epoll_create1");
+
+  if (fd >= size) {
+    if (!(watches = realloc(watches, (fd + 1) * sizeof(*watches))))
+      err(EXIT_FAILURE, "realloc");
+    memset(watches + size, 0, (fd + 1 - size) * sizeof(*watches));
+    size = fd + 1;
+  }
+
+  if (!watches[fd].handler)
+    watches[fd].generation = ++generation;
+  event.data.u64 = (uint64_t) watches[fd].generation << 32 | fd;
+
+  if (watches[fd].handler && !watches[fd].ready) {
+    if (epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &event) < 0)
+      err(EXIT_FAILURE, "epoll_ctl");
+  } else if (!watches[fd].handler) {
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) >= 0)
+      watches[fd].ready = 0;
+    else if (errno == EPERM)
+      watches[fd].ready = 1, ready++;
+    else
+      err(EXIT_FAILURE, "epoll_ctl");
+  }
+
+  watches[fd].handler = handler;
+  watches[fd].data = data;
+}
+
+void watchpid(pid_t pid, void (*handler)(pid_t, int, void *), void *data) {
+  struct child *child;
+  int fd;
+
+  if (!(child = malloc(sizeof(*child))))
+    err(EXIT_FAILURE, "malloc");
+  child->pid = pid;
+  child->handler = handler;
+  child->data = data;
+
+  if ((fd = syscall(__NR_pidfd_open, pid, 0)) >= 0) {
+    watchfd(fd, EPOLLIN, reap, child);
+    return;
+  }
+
+  /* Kernels before 5.3 have no pidfds, so fall back to checking children
+     on SIGCHLD, raised once here in case this one has already exited. */
+  child->next = waiting;
+  waiting = child;
+  watchsignal(SIGCHLD, sweep, NULL);
+  raise(SIGCHLD);
+}
+
+void watchsignal(int signal, void (*handler)(int, void *), void *data) {
+  handlers[signal] = handler;
+  contexts[signal] = data;
+
+  if (signals < 0)
+    sigemptyset(&mask);
+  sigaddset(&mask, signal);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+
+  if (signals >= 0 && signalfd(signals, &mask, 0) < 0)
+    err(EXIT_FAILURE, "signalfd");
+  if (signals < 0 && (signals = signalfd(-1, &mask, SFD_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "signalfd");
+  watchfd(signals, EPOLLIN, deliver, NULL);
+}
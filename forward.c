@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include "contain.h"
+
+#define EXPIRY 60
+
+struct forward {
+  int type;
+  in_port_t from, to;
+  struct forward *next;
+};
+
+struct half {
+  int done, events, full, in, out, pipe[2];
+  size_t queued;
+};
+
+struct relay {
+  int connecting;
+  size_t capacity;
+  struct half halves[2];
+};
+
+struct flow {
+  int inside, outside;
+  time_t active;
+  struct sockaddr_in peer;
+  struct flow *next;
+};
+
+static struct flow *flows;
+static struct forward *forwards;
+
+static int connectinside(struct forward *forward) {
+  int fd;
+  struct sockaddr_in address = {
+    .sin_family = AF_INET,
+    .sin_port = htons(forward->to),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+
+  /* The supervisor has already moved into the container network namespace
+     by the time it relays any traffic, so this reaches the container. */
+  fd = socket(AF_INET, forward->type | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+    if (errno != EINPROGRESS) {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+static time_t now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static long parseport(char **text) {
+  char *start = *text;
+  long port;
+
+  port = strtol(start, text, 10);
+  return *text == start || port <= 0 || port > 65535 ? -1 : port;
+}
+
+static void release(struct relay *relay) {
+  int index;
+
+  for (index = 0; index < 2; index++) {
+    unwatchfd(relay->halves[index].in);
+    close(relay->halves[index].in);
+    if (relay->halves[index].pipe[0] >= 0)
+      close(relay->halves[index].pipe[0]);
+    if (relay->halves[index].pipe[1] >= 0)
+      close(relay->halves[index].pipe[1]);
+  }
+  free(relay);
+}
+
+static void pump(int fd, int events, void *data) {
+  int error, index;
+  socklen_t size = sizeof(error);
+  ssize_t count;
+  struct half *half, *other;
+  struct relay *relay = data;
+
+  if (events & EPOLLERR) {
+    release(relay);
+    return;
+  }
+
+  if (relay->connecting) {
+    if (getsockopt(relay->halves[0].out, SOL_SOCKET, SO_ERROR, &error,
+          &size) < 0 || error) {
+      release(relay);
+      return;
+    }
+    if (fd != relay->halves[0].out)
+      return;
+    relay->connecting = 0;
+  }
+
+  /* Each direction moves data from its source socket into a pipe and from
+     the pipe to its destination socket, so it is never copied to user
+     space. A pipe can run out of buffers before it holds capacity bytes,
+     so reads also stop after EAGAIN with data queued until it drains. */
+  for (index = 0; index < 2; index++) {
+    half = relay->halves + index;
+    if (!half->done && !half->full && half->queued < relay->capacity) {
+      count = splice(half->in, NULL, half->pipe[1], NULL,
+        relay->capacity - half->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (count > 0)
+        half->queued += count;
+      else if (count == 0)
+        half->done = 1;
+      else if (errno == EAGAIN)
+        half->full = half->queued > 0;
+      else if (errno != EINTR) {
+        release(relay);
+        return;
+      }
+    }
+
+    if (half->queued > 0) {
+      count = splice(half->pipe[0], NULL, half->out, NULL, half->queued,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (count > 0)
+        half->queued -= count, half->full = 0;
+      else if (count < 0 && errno != EAGAIN && errno != EINTR) {
+        release(relay);
+        return;
+      }
+    }
+
+    if (half->done == 1 && half->queued == 0) {
+      shutdown(half->out, SHUT_WR);
+      half->done = 2;
+    }
+  }
+
+  if (relay->halves[0].done == 2 && relay->halves[1].done == 2) {
+    release(relay);
+    return;
+  }
+
+  for (index = 0; index < 2; index++) {
+    half = relay->halves + index;
+    other = relay->halves + 1 - index;
+    events = other->queued > 0 ? EPOLLOUT : 0;
+    if (!half->done && !half->full && half->queued < relay->capacity)
+      events |= EPOLLIN;
+    if (events != half->events)
+      watchfd(half->in, half->events = events, pump, relay);
+  }
+}
+
+static void accepted(int fd, int events, void *data) {
+  int client, index, server;
+  struct relay *relay;
+
+  client = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (client < 0)
+    return;
+  if ((server = connectinside(data)) < 0) {
+    close(client);
+    return;
+  }
+
+  if (!(relay = calloc(1, sizeof(*relay))))
+    err(EXIT_FAILURE, "calloc");
+  relay->connecting = 1;
+  relay->halves[0].in = relay->halves[1].out = client;
+  relay->halves[0].out = relay->halves[1].in = server;
+  relay->halves[1].events = EPOLLOUT;
+
+  for (index = 0; index < 2; index++)
+    relay->halves[index].pipe[0] = relay->halves[index].pipe[1] = -1;
+  for (index = 0; index < 2; index++)
+    if (pipe2(relay->halves[index].pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+      release(relay);
+      return;
+    }
+  relay->capacity = fcntl(relay->halves[0].pipe[0], F_GETPIPE_SZ);
+
+  watchfd(client, 0, pump, relay);
+  watchfd(server, EPOLLOUT, pump, relay);
+}
+
+static void answered(int fd, int events, void *data) {
+  static char buffer[65536];
+  ssize_t length;
+  struct flow *flow = data;
+
+  if ((length = recv(fd, buffer, sizeof(buffer), 0)) < 0)
+    return;
+  flow->active = now();
+  sendto(flow->outside, buffer, length, 0, (struct sockaddr *) &flow->peer,
+    sizeof(flow->peer));
+}
+
+static void expire(int fd, int events, void *data) {
+  struct flow *flow, **link;
+  uint64_t ticks;
+
+  if (read(fd, &ticks, sizeof(ticks)) < 0)
+    return;
+
+  for (link = &flows; (flow = *link); )
+    if (flow->active + EXPIRY < now()) {
+      *link = flow->next;
+      unwatchfd(flow->inside);
+      close(flow->inside);
+      free(flow);
+    } else {
+      link = &flow->next;
+    }
+}
+
+static void received(int fd, int events, void *data) {
+  static char buffer[65536];
+  socklen_t size;
+  ssize_t length;
+  struct flow *flow;
+  struct sockaddr_in peer;
+
+  size = sizeof(peer);
+  length = recvfrom(fd, buffer, sizeof(buffer), 0,
+    (struct sockaddr *) &peer, &size);
+  if (length < 0)
+    return;
+
+  /* Datagrams from each host peer go through their own connected socket
+     in the container, so replies can be routed back to the right peer. */
+  for (flow = flows; flow; flow = flow->next)
+    if (flow->outside == fd && flow->peer.sin_port == peer.sin_port)
+      if (flow->peer.sin_addr.s_addr == peer.sin_addr.s_addr)
+        break;
+
+  if (!flow) {
+    if (!(flow = calloc(1, sizeof(*flow))))
+      err(EXIT_FAILURE, "calloc");
+    if ((flow->inside = connectinside(data)) < 0) {
+      free(flow);
+      return;
+    }
+    flow->outside = fd;
+    flow->peer = peer;
+    flow->next = flows;
+    flows = flow;
+    watchfd(flow->inside, EPOLLIN, answered, flow);
+  }
+
+  flow->active = now();
+  send(flow->inside, buffer, length, 0);
+}
+
+static void expiring(void) {
+  int fd;
+  struct itimerspec interval = {
+    .it_interval.tv_sec = EXPIRY,
+    .it_value.tv_sec = EXPIRY
+  };
+
+  /* Idle flows are swept on a timer rather than when new datagrams arrive,
+     so their container sockets are still closed once traffic stops. */
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0)
+    err(EXIT_FAILURE, "timerfd_create");
+  if (timerfd_settime(fd, 0, &interval, NULL) < 0)
+    err(EXIT_FAILURE, "timerfd_settime");
+  watchfd(fd, EPOLLIN, expire, NULL);
+}
+
+void openforwards(void) {
+  int fd, one = 1, udp = 0;
+  struct forward *forward;
+  struct sockaddr_in address = { .sin_family = AF_INET };
+
+  for (forward = forwards; forward; forward = forward->next) {
+    fd = socket(AF_INET, forward->type | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+      err(EXIT_FAILURE, "socket");
+    if (forward->type == SOCK_STREAM)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    address.sin_port = htons(forward->from);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+      err(EXIT_FAILURE, "Failed to bind host port %u", forward->from);
+
+    if (forward->type == SOCK_DGRAM) {
+      watchfd(fd, EPOLLIN, received, forward);
+      udp = 1;
+    } else {
+      if (listen(fd, SOMAXCONN) < 0)
+        err(EXIT_FAILURE, "listen");
+      watchfd(fd, EPOLLIN, accepted, forward);
+    }
+  }
+
+  if (udp)
+    expiring();
+}
+
+void setforward(char *spec) {
+  char *text = spec;
+  long from, to;
+  struct forward *forward;
+
+  if (!(forward = calloc(1, sizeof(*forward))))
+    err(EXIT_FAILURE, "calloc");
+
+  forward->type = SOCK_STREAM;
+  if (strncmp(text, "tcp:", 4) == 0) {
+    text += 4;
+  } else if (strncmp(text, "udp:", 4) == 0) {
+    forward->type = SOCK_DGRAM;
+    text += 4;
+  }
+
+  from = to = parseport(&text);
+  if (from > 0 && *text == ':') {
+    text++;
+    to = parseport(&text);
+  }
+  if (from < 0 || to < 0 || *text)
+    errx(EXIT_FAILURE, "Invalid port forward '%s'", spec);
+
+  forward->from = from;
+  forward->to = to;
+  forward->next = forwards;
+  forwards = forward;
+}
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "contain.h"
+
+void runinit(void) {
+  int fd, status;
+  pid_t child, pid;
+  siginfo_t info;
+  sigset_t mask, saved;
+
+  /* Every signal is blocked and collected with sigwaitinfo() below, which
+     also sidesteps the kernel ignoring unhandled signals sent to PID 1. */
+  sigfillset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, &saved);
+
+  switch (child = fork()) {
+    case -1:
+      err(EXIT_FAILURE, "fork");
+    case 0:
+      /* Return to exec the container command in its own process group, in
+         the foreground of the console if there is one. */
+      setpgid(0, 0);
+      tcsetpgrp(STDIN_FILENO, getpid());
+      sigprocmask(SIG_SETMASK, &saved, NULL);
+      return;
+  }
+  setpgid(child, child);
+
+  /* This init never execs, so close everything it inherited from contain,
+     such as forwarded host sockets and cgroup directories, by hand. */
+  if (syscall(__NR_close_range, 3, ~0U, 0) < 0)
+    for (fd = sysconf(_SC_OPEN_MAX) - 1; fd > 2; fd--)
+      close(fd);
+
+  while (1) {
+    if (sigwaitinfo(&mask, &info) < 0) {
+      if (errno != EINTR)
+        err(EXIT_FAILURE, "sigwaitinfo");
+      continue;
+    }
+
+    if (info.si_signo != SIGCHLD) {
+      if (kill(-child, info.si_signo) < 0)
+        kill(child, info.si_signo);
+      continue;
+    }
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+      if (pid == child) {
+        if (WIFSIGNALED(status))
+          _exit(128 + WTERMSIG(status));
+        _exit(WEXITSTATUS(status));
+      }
+  }
+}
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <poll.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,6 +16,17 @@
 #include <sys/types.h>
 #include "contain.h"
 
+static void freeze(pid_t parent, int frozen) {
+  char *group;
+
+  if (!(group = findcgroup(parent)))
+    errx(EXIT_FAILURE, "PID %u has no container cgroup to freeze", parent);
+  if (writecgroup(group, "cgroup.freeze", frozen ? "1" : "0") < 0)
+    errx(EXIT_FAILURE, "Failed to %s container", frozen ? "freeze" : "thaw");
+  waitcgroup(group, frozen ? "frozen 1" : "frozen 0");
+  free(group);
+}
+
 static int getparent(pid_t child) {
   char *end, *line = NULL, *path, *start;
   pid_t parent = -1;
@@ -41,80 +53,160 @@ static int getparent(pid_t child) {
   return parent;
 }
 
-static void join(pid_t pid, char *type) {
-  char *path;
-  int fd;
-
-  path = string("/proc/%u/ns/%s", pid, type);
+static int iscontainer(pid_t pid) {
+  char *item = NULL, *path;
+  int result = 0;
+  size_t size;
+  FILE *file;
 
-  if ((fd = open(path, O_RDONLY)) >= 0) {
-    if (syscall(__NR_setns, fd, 0) < 0 && strcmp(type, "user") == 0)
-      errx(EXIT_FAILURE, "Failed to join user namespace");
-    close(fd);
-  } else if (errno != ENOENT) {
-    errx(EXIT_FAILURE, "PID %u does not belong to you", pid);
-  } else if (strcmp(type, "user") == 0) {
-    errx(EXIT_FAILURE, "PID %u not found or user namespace unavailable", pid);
+  path = string("/proc/%u/environ", pid);
+  if ((file = fopen(path, "r"))) {
+    while (getdelim(&item, &size, '\0', file) >= 0)
+      if (strcmp(item, "container=contain") == 0)
+        result = 1;
+    fclose(file);
   }
 
+  if (item)
+    free(item);
   free(path);
+  return result;
 }
 
-static void usage(const char *progname) {
-  fprintf(stderr, "Usage: %s PID [CMD [ARG]...]\n", progname);
-  exit(64);
-}
-
-int main(int argc, char **argv, char **envp) {
-  char *end, *item = NULL, *path;
-  pid_t child = -1, parent, pid;
+static int isinit(pid_t pid) {
+  char *line = NULL, *path, *start;
+  int result = 0;
   size_t size;
-  struct dirent *entry;
-  DIR *dir;
   FILE *file;
 
-  seal(argv, envp);
-  if (argc < 2)
-    usage(argv[0]);
+  path = string("/proc/%u/status", pid);
+  if ((file = fopen(path, "r"))) {
+    while (getline(&line, &size, file) >= 0)
+      if (strncmp(line, "NSpid:", 6) == 0)
+        if ((start = strrchr(line, '\t')) && strcmp(start, "\t1\n") == 0)
+          result = 1;
+    fclose(file);
+  }
 
-  parent = strtol(argv[1], &end, 10);
-  if (end == argv[1] || *end)
-    usage(argv[0]);
+  if (line)
+    free(line);
+  free(path);
+  return result;
+}
 
-  if (geteuid() != getuid())
-    errx(EXIT_FAILURE, "setuid installation is unsafe");
-  else if (getegid() != getgid())
-    errx(EXIT_FAILURE, "setgid installation is unsafe");
+static pid_t findinit(pid_t parent) {
+  char *end;
+  pid_t child = -1, pid;
+  struct dirent *entry;
+  DIR *dir = NULL;
 
   join(parent, "user");
   setgid(0);
   setgroups(0, NULL);
   setuid(0);
 
-  if (!(dir = opendir("/proc")))
+  /* Containers supervised with contain -m are identified by their init. */
+  if (isinit(parent) && iscontainer(parent))
+    child = parent;
+  else if (!(dir = opendir("/proc")))
     errx(EXIT_FAILURE, "Failed to list processes");
   while (child < 0 && (entry = readdir(dir))) {
     pid = strtol(entry->d_name, &end, 10);
     if (end == entry->d_name || *end)
       continue;
-    if (getparent(pid) == parent) {
-      path = string("/proc/%u/environ", pid);
-      if ((file = fopen(path, "r"))) {
-        while (getdelim(&item, &size, '\0', file) >= 0)
-          if (strcmp(item, "container=contain") == 0)
-            child = pid;
-        fclose(file);
-      }
-      free(path);
-    }
+    if (getparent(pid) == parent && iscontainer(pid))
+      child = pid;
   }
-  closedir(dir);
-  if (item)
-    free(item);
+  if (dir)
+    closedir(dir);
 
   if (child < 0)
     errx(EXIT_FAILURE, "PID %u is not a container supervisor", parent);
+  return child;
+}
+
+static void waitfd(int fd) {
+  struct pollfd fds[1] = {{ .fd = fd, .events = POLLIN }};
+
+  while (poll(fds, 1, -1) < 0)
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "poll");
+}
+
+static void terminate(pid_t parent) {
+  char *group;
+  int init, supervisor;
+
+  if ((supervisor = syscall(__NR_pidfd_open, parent, 0)) < 0)
+    errx(EXIT_FAILURE, "PID %u not found", parent);
+
+  if ((group = findcgroup(parent))
+      && writecgroup(group, "cgroup.kill", "1") >= 0) {
+    waitcgroup(group, "populated 0");
+    free(group);
+  } else {
+    if ((init = syscall(__NR_pidfd_open, findinit(parent), 0)) < 0)
+      err(EXIT_FAILURE, "pidfd_open");
+    if (syscall(__NR_pidfd_send_signal, init, SIGKILL, NULL, 0) < 0)
+      err(EXIT_FAILURE, "pidfd_send_signal");
+    waitfd(init);
+  }
+
+  /* The supervisor holds the remaining namespaces until it exits. */
+  waitfd(supervisor);
+}
+
+static void usage(const char *progname) {
+  fprintf(stderr, "\
+Usage: %s PID [CMD [ARG]...]\n\
+       %s -f|-k|-t PID\n\
+Options:\n\
+  -f        freeze the container and wait until it is frozen\n\
+  -k        kill the container and wait for it to be torn down\n\
+  -t        thaw a frozen container and wait until it is running\n\
+", progname, progname);
+  exit(64);
+}
+
+int main(int argc, char **argv, char **envp) {
+  char *end;
+  int action = 0, option;
+  pid_t child, parent;
+
+  seal(argv, envp);
+  while ((option = getopt(argc, argv, "+:fkt")) > 0)
+    switch (option) {
+      case 'f':
+      case 'k':
+      case 't':
+        if (action)
+          usage(argv[0]);
+        action = option;
+        break;
+      default:
+        usage(argv[0]);
+    }
+
+  if (argc <= optind || (action && argc > optind + 1))
+    usage(argv[0]);
+
+  parent = strtol(argv[optind], &end, 10);
+  if (end == argv[optind] || *end)
+    usage(argv[0]);
+
+  if (geteuid() != getuid())
+    errx(EXIT_FAILURE, "setuid installation is unsafe");
+  else if (getegid() != getgid())
+    errx(EXIT_FAILURE, "setgid installation is unsafe");
+
+  if (action == 'f' || action == 't')
+    freeze(parent, action == 'f');
+  else if (action == 'k')
+    terminate(parent);
+  if (action)
+    return EXIT_SUCCESS;
 
+  child = findinit(parent);
   join(child, "cgroup");
   join(child, "ipc");
   join(child, "net");
@@ -130,8 +222,8 @@ int main(int argc, char **argv, char **envp) {
     case -1:
       err(EXIT_FAILURE, "fork");
     case 0:
-      if (argv[2])
-        execvp(argv[2], argv + 2);
+      if (argv[optind + 1])
+        execvp(argv[optind + 1], argv + optind + 1);
       else if (getenv("SHELL"))
         execl(getenv("SHELL"), getenv("SHELL"), NULL);
       else
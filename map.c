@@ -178,6 +178,17 @@ static char *userdefault(int type) {
   return result;
 }
 
+unsigned getroot(int type, char *map) {
+  unsigned count, first, lower;
+
+  if (!map)
+    map = (getuid() == 0 ? rootdefault : userdefault)(type);
+  while ((map = mapitem(map, &first, &lower, &count)))
+    if (first == 0 && count > 0)
+      return lower;
+  return INVALID;
+}
+
 static void validate(char *range, unsigned first, unsigned count) {
   unsigned length, start;
 
@@ -2,15 +2,134 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <mntent.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <linux/magic.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include "contain.h"
 
-static char *root;
+/* Older C libraries lack the new mount API definitions from linux/mount.h,
+   which cannot safely be included alongside their sys/mount.h. */
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#define MOVE_MOUNT_T_EMPTY_PATH 0x00000040
+#define OPEN_TREE_CLONE 1
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+
+struct mount_attr {
+  uint64_t attr_set, attr_clr, propagation, userns_fd;
+};
+#endif
+
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+
+struct bind {
+  char *src, *dst;
+  int readonly;
+  struct bind *next;
+};
+
+static char *hugepages, *root, *shm;
+static struct bind *binds, *devices;
+
+static void makeparents(char *path) {
+  char *slash;
+
+  for (slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    mkdir(path, 0755);
+    *slash = '/';
+  }
+}
+
+static int resolve(char *dst, int directory) {
+  char *name, *path, *rest;
+  int dir, fd, flags;
+  struct stat st;
+
+  if (!(path = rest = strdup(dst)))
+    err(EXIT_FAILURE, "strdup");
+  if ((dir = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+    errx(EXIT_FAILURE, "Failed to open new root filesystem");
+
+  /* The host root is still visible, so DST is walked a component at a time
+     from the new root refusing symlinks and .., or the container could
+     redirect the bind and the directories created for it onto the host. */
+  while ((name = strsep(&rest, "/"))) {
+    if (!*name || strcmp(name, ".") == 0)
+      continue;
+    if (strcmp(name, "..") == 0)
+      errx(EXIT_FAILURE, "Invalid bind mount destination '%s'", dst);
+
+    flags = O_PATH | O_NOFOLLOW | O_CLOEXEC;
+    if (rest || directory) {
+      mkdirat(dir, name, 0755);
+      flags |= O_DIRECTORY;
+    } else if ((fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL
+          | O_NOFOLLOW | O_CLOEXEC, 0644)) >= 0) {
+      close(fd);
+    }
+
+    fd = openat(dir, name, flags);
+    if (fd < 0 || fstat(fd, &st) < 0 || S_ISLNK(st.st_mode))
+      errx(EXIT_FAILURE, "Failed to find %s in new root filesystem", dst);
+    close(dir);
+    dir = fd;
+  }
+
+  free(path);
+  return dir;
+}
+
+static void bindpath(struct bind *bind) {
+  char *target;
+  int dst, fd;
+  struct mount_attr attr = { .attr_set = MOUNT_ATTR_RDONLY };
+  struct stat st;
+
+  if (stat(bind->src, &st) < 0)
+    err(EXIT_FAILURE, "%s", bind->src);
+  dst = resolve(bind->dst, S_ISDIR(st.st_mode));
+
+  if (!bind->readonly) {
+    target = string("/proc/self/fd/%d", dst);
+    if (mount(bind->src, target, NULL, MS_BIND | MS_REC, NULL) < 0)
+      errx(EXIT_FAILURE, "Failed to bind %s into new root filesystem",
+        bind->src);
+    free(target);
+    close(dst);
+    return;
+  }
+
+  /* Make a detached copy of the tree read-only before attaching it, so
+     the container never sees any part of it writable. */
+  fd = syscall(__NR_open_tree, AT_FDCWD, bind->src,
+    OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+  if (fd >= 0) {
+    if (syscall(__NR_mount_setattr, fd, "", AT_EMPTY_PATH | AT_RECURSIVE,
+          &attr, sizeof(attr)) >= 0)
+      if (syscall(__NR_move_mount, fd, "", dst, "",
+            MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH) >= 0) {
+        close(dst);
+        close(fd);
+        return;
+      }
+    close(fd);
+  }
+  errx(EXIT_FAILURE, "Failed to bind %s read-only into new root filesystem",
+    bind->src);
+}
 
 static void bindnode(char *src, char *dst) {
   int fd;
@@ -21,6 +140,36 @@ static void bindnode(char *src, char *dst) {
     errx(EXIT_FAILURE, "Failed to bind %s into new /dev filesystem", src);
 }
 
+static char *findhugepages(char *spec) {
+  char *option, *result = NULL;
+  size_t length;
+  struct mntent *entry;
+  struct statfs fs;
+  FILE *mounts;
+
+  if (*spec == '/') {
+    if (statfs(spec, &fs) < 0 || fs.f_type != HUGETLBFS_MAGIC)
+      errx(EXIT_FAILURE, "%s is not a hugetlbfs mount", spec);
+    return string("%s", spec);
+  }
+
+  /* Otherwise pick the first host hugetlbfs mount with this page size. */
+  if (!(mounts = setmntent("/proc/self/mounts", "r")))
+    err(EXIT_FAILURE, "/proc/self/mounts");
+  length = strlen(spec);
+  while (!result && (entry = getmntent(mounts)))
+    if (strcmp(entry->mnt_type, "hugetlbfs") == 0)
+      if ((option = hasmntopt(entry, "pagesize")))
+        if (strncasecmp(option + 9, spec, length) == 0)
+          if (option[9 + length] == ',' || option[9 + length] == 0)
+            result = string("%s", entry->mnt_dir);
+  endmntent(mounts);
+
+  if (!result)
+    errx(EXIT_FAILURE, "No hugetlbfs is mounted with page size %s", spec);
+  return result;
+}
+
 static void cleanup(void) {
   if (root) {
     umount2(root, MNT_DETACH);
@@ -29,8 +178,11 @@ static void cleanup(void) {
 }
 
 void createroot(char *src, int console, char *helper) {
+  char *options, *path;
   mode_t mask;
   pid_t child;
+  struct bind *bind;
+  struct stat st;
 
   root = tmpdir();
   atexit(cleanup);
@@ -49,6 +201,20 @@ void createroot(char *src, int console, char *helper) {
   if (mount("devpts", "dev/pts", "devpts", 0, "newinstance,ptmxmode=666") < 0)
     errx(EXIT_FAILURE, "Failed to mount /dev/pts in new root filesystem");
 
+  mkdir("dev/shm", 01777);
+  options = string("mode=1777%s%s", shm ? "," : "", shm ? shm : "");
+  if (mount("tmpfs", "dev/shm", "tmpfs", MS_NOSUID | MS_NODEV, options) < 0)
+    errx(EXIT_FAILURE, "Failed to mount /dev/shm in new root filesystem");
+  free(options);
+
+  if (hugepages) {
+    path = findhugepages(hugepages);
+    mkdir("dev/hugepages", 0755);
+    if (mount(path, "dev/hugepages", NULL, MS_BIND, NULL) < 0)
+      errx(EXIT_FAILURE, "Failed to bind %s into new /dev filesystem", path);
+    free(path);
+  }
+
   mkdir("dev/tmp", 0755);
   umask(mask);
 
@@ -62,6 +228,23 @@ void createroot(char *src, int console, char *helper) {
   bindnode("/dev/zero", "dev/zero");
   symlink("pts/ptmx", "dev/ptmx");
 
+  /* Extra devices are only bound where they exist on this host, so one
+     configuration can be used across hosts with different hardware. */
+  for (bind = devices; bind; bind = bind->next)
+    if (stat(bind->src, &st) >= 0) {
+      if (!S_ISCHR(st.st_mode) && !S_ISBLK(st.st_mode))
+        errx(EXIT_FAILURE, "%s is not a device node", bind->src);
+      mask = umask(0);
+      makeparents(bind->dst);
+      umask(mask);
+      bindnode(bind->src, bind->dst);
+    }
+
+  mask = umask(0);
+  for (bind = binds; bind; bind = bind->next)
+    bindpath(bind);
+  umask(mask);
+
   if (helper)
     switch (child = fork()) {
       case -1:
@@ -114,3 +297,52 @@ void mountsys(void) {
     errx(EXIT_FAILURE, "Failed to mount /sys in new root filesystem");
   mount("cgroup2", "sys/fs/cgroup", "cgroup2", 0, NULL);
 }
+
+void setbind(char *spec) {
+  char *mode;
+  struct bind *bind, **link;
+
+  if (!(bind = calloc(1, sizeof(*bind))))
+    err(EXIT_FAILURE, "calloc");
+  bind->src = spec;
+
+  if (!(bind->dst = strchr(spec, ':')))
+    errx(EXIT_FAILURE, "Invalid bind mount '%s'", spec);
+  *bind->dst++ = 0;
+  if ((mode = strchr(bind->dst, ':'))) {
+    *mode++ = 0;
+    if (strcmp(mode, "ro") == 0)
+      bind->readonly = 1;
+    else if (strcmp(mode, "rw") != 0)
+      errx(EXIT_FAILURE, "Invalid bind mount mode '%s'", mode);
+  }
+  if (!*bind->src || !*bind->dst)
+    errx(EXIT_FAILURE, "Invalid bind mount '%s'", spec);
+
+  /* Keep binds in the order given so later ones can nest in earlier ones. */
+  for (link = &binds; *link; link = &(*link)->next);
+  *link = bind;
+}
+
+void setdevice(char *spec) {
+  struct bind *bind, **link;
+
+  if (strncmp(spec, "/dev/", 5) || !spec[5] || strstr(spec, "/../"))
+    errx(EXIT_FAILURE, "Invalid device '%s'", spec);
+
+  if (!(bind = calloc(1, sizeof(*bind))))
+    err(EXIT_FAILURE, "calloc");
+  bind->src = spec;
+  bind->dst = spec + 1;
+
+  for (link = &devices; *link; link = &(*link)->next);
+  *link = bind;
+}
+
+void sethugepages(char *spec) {
+  hugepages = spec;
+}
+
+void setshm(char *options) {
+  shm = options;
+}
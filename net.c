@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/nsfs.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "contain.h"
+
+#define ADDRESSES 8
+
+struct address {
+  int family, prefix;
+  unsigned char data[16];
+};
+
+static char buffer[8192], *host, *name = "eth0";
+static int mtu, pending, sequence, veth;
+static size_t length;
+static struct address gateway, inner[ADDRESSES], outer[ADDRESSES];
+
+static void *put(size_t size) {
+  void *result = buffer + length;
+
+  if (length + NLMSG_ALIGN(size) > sizeof(buffer))
+    errx(EXIT_FAILURE, "Network configuration is too large");
+  memset(result, 0, NLMSG_ALIGN(size));
+  length += NLMSG_ALIGN(size);
+  return result;
+}
+
+static struct nlmsghdr *begin(int type, int flags) {
+  struct nlmsghdr *header = put(sizeof(struct nlmsghdr));
+
+  header->nlmsg_type = type;
+  header->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+  header->nlmsg_seq = ++sequence;
+  pending++;
+  return header;
+}
+
+static struct rtattr *attribute(int type, const void *data, size_t size) {
+  struct rtattr *attr = put(RTA_LENGTH(0));
+
+  attr->rta_type = type;
+  attr->rta_len = RTA_LENGTH(size);
+  if (size > 0)
+    memcpy(put(size), data, size);
+  return attr;
+}
+
+static void end(struct nlmsghdr *header) {
+  header->nlmsg_len = buffer + length - (char *) header;
+}
+
+static void nested(struct rtattr *attr) {
+  attr->rta_len = buffer + length - (char *) attr;
+}
+
+static void transact(int sock, char *what) {
+  char reply[8192];
+  ssize_t size;
+  struct nlmsgerr *error;
+  struct nlmsghdr *header;
+
+  while (send(sock, buffer, length, 0) < 0)
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "send");
+  length = 0;
+
+  while (pending > 0) {
+    if ((size = recv(sock, reply, sizeof(reply), 0)) < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "recv");
+      continue;
+    }
+
+    header = (struct nlmsghdr *) reply;
+    for (; NLMSG_OK(header, size); header = NLMSG_NEXT(header, size)) {
+      if (header->nlmsg_type != NLMSG_ERROR)
+        continue;
+      pending--;
+      error = NLMSG_DATA(header);
+      if (error->error < 0) {
+        errno = -error->error;
+        err(EXIT_FAILURE, "Failed to %s", what);
+      }
+    }
+  }
+}
+
+static void addaddress(int index, struct address *address) {
+  struct ifaddrmsg *ifa;
+  struct nlmsghdr *header;
+  size_t size = address->family == AF_INET ? 4 : 16;
+
+  header = begin(RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL);
+  ifa = put(sizeof(struct ifaddrmsg));
+  ifa->ifa_family = address->family;
+  ifa->ifa_prefixlen = address->prefix;
+  ifa->ifa_index = index;
+  attribute(IFA_LOCAL, address->data, size);
+  attribute(IFA_ADDRESS, address->data, size);
+  end(header);
+}
+
+static void linkup(int index) {
+  struct ifinfomsg *ifi;
+  struct nlmsghdr *header;
+
+  header = begin(RTM_NEWLINK, 0);
+  ifi = put(sizeof(struct ifinfomsg));
+  ifi->ifi_index = index;
+  ifi->ifi_flags = ifi->ifi_change = IFF_UP;
+  end(header);
+}
+
+static int netlink(void) {
+  int sock;
+
+  sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (sock < 0)
+    err(EXIT_FAILURE, "socket");
+  return sock;
+}
+
+int opennetns(char *path) {
+  int fd, parent, userns;
+  uid_t owner;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "open %s", path);
+  if (ioctl(fd, NS_GET_NSTYPE) != CLONE_NEWNET)
+    errx(EXIT_FAILURE, "%s is not a network namespace", path);
+  if (getuid() == 0)
+    return fd;
+
+  /* The namespace is joined with setuid privilege, so an unprivileged user
+     may only join one owned by a user namespace they created, or by one
+     nested within such a namespace. */
+  if ((userns = ioctl(fd, NS_GET_USERNS)) < 0)
+    err(EXIT_FAILURE, "Failed to find owner of network namespace %s", path);
+  while (ioctl(userns, NS_GET_OWNER_UID, &owner) < 0 || owner != getuid()) {
+    if ((parent = ioctl(userns, NS_GET_PARENT)) < 0)
+      errx(EXIT_FAILURE, "Network namespace %s does not belong to you", path);
+    close(userns);
+    userns = parent;
+  }
+  close(userns);
+  return fd;
+}
+
+static void parseaddress(struct address *address, char *text, int prefix) {
+  char *end, *slash;
+  long value;
+
+  if ((slash = strchr(text, '/')))
+    *slash = 0;
+  if (inet_pton(AF_INET, text, address->data) == 1)
+    address->family = AF_INET;
+  else if (inet_pton(AF_INET6, text, address->data) == 1)
+    address->family = AF_INET6;
+  else
+    errx(EXIT_FAILURE, "Invalid network address '%s'", text);
+
+  address->prefix = address->family == AF_INET ? 32 : 128;
+  if (slash) {
+    *slash = '/';
+    value = strtol(slash + 1, &end, 10);
+    if (!prefix || end == slash + 1 || *end || value < 0)
+      errx(EXIT_FAILURE, "Invalid network address '%s'", text);
+    if (value > address->prefix)
+      errx(EXIT_FAILURE, "Invalid network address '%s'", text);
+    address->prefix = value;
+  }
+}
+
+static void parselist(struct address *list, char *text) {
+  int index;
+
+  for (index = 0; index < ADDRESSES && list[index].family; index++);
+  if (index == ADDRESSES)
+    errx(EXIT_FAILURE, "Too many veth addresses");
+  parseaddress(list + index, text, 1);
+}
+
+void makeveth(pid_t pid) {
+  char *hostname;
+  int address, index, sock;
+  struct nlmsghdr *header;
+  struct rtattr *data, *info, *peer;
+
+  if (!veth)
+    return;
+
+  hostname = host ? host : string("contain-%u", pid);
+  sock = netlink();
+
+  header = begin(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL);
+  put(sizeof(struct ifinfomsg));
+  attribute(IFLA_IFNAME, hostname, strlen(hostname) + 1);
+  if (mtu > 0)
+    attribute(IFLA_MTU, &mtu, sizeof(mtu));
+  info = attribute(IFLA_LINKINFO, NULL, 0);
+  attribute(IFLA_INFO_KIND, "veth", 5);
+  data = attribute(IFLA_INFO_DATA, NULL, 0);
+  peer = attribute(VETH_INFO_PEER, NULL, 0);
+  put(sizeof(struct ifinfomsg));
+  attribute(IFLA_IFNAME, name, strlen(name) + 1);
+  if (mtu > 0)
+    attribute(IFLA_MTU, &mtu, sizeof(mtu));
+  attribute(IFLA_NET_NS_PID, &pid, sizeof(pid));
+  nested(peer);
+  nested(data);
+  nested(info);
+  end(header);
+  transact(sock, "create veth pair");
+
+  if (!(index = if_nametoindex(hostname)))
+    err(EXIT_FAILURE, "Failed to find %s", hostname);
+  for (address = 0; address < ADDRESSES && outer[address].family; address++)
+    addaddress(index, outer + address);
+  linkup(index);
+  transact(sock, "configure host veth interface");
+
+  close(sock);
+  if (hostname != host)
+    free(hostname);
+}
+
+void setveth(char *spec) {
+  char *const keys[] = { "address", "gateway", "host", "mtu", "name", "peer",
+    NULL };
+  char *end, *value;
+
+  veth = 1;
+  while (*spec)
+    switch (getsubopt(&spec, keys, &value)) {
+      case 0:
+        if (!value)
+          errx(EXIT_FAILURE, "Missing veth address");
+        parselist(inner, value);
+        break;
+      case 1:
+        if (!value)
+          errx(EXIT_FAILURE, "Missing veth gateway");
+        parseaddress(&gateway, value, 0);
+        break;
+      case 2:
+        if (!value || !*value || strlen(value) >= IFNAMSIZ)
+          errx(EXIT_FAILURE, "Invalid veth host interface name");
+        host = value;
+        break;
+      case 3:
+        mtu = value ? strtol(value, &end, 10) : 0;
+        if (!value || end == value || *end || mtu <= 0)
+          errx(EXIT_FAILURE, "Invalid veth MTU");
+        break;
+      case 4:
+        if (!value || !*value || strlen(value) >= IFNAMSIZ)
+          errx(EXIT_FAILURE, "Invalid veth interface name");
+        name = value;
+        break;
+      case 5:
+        if (!value)
+          errx(EXIT_FAILURE, "Missing veth peer address");
+        parselist(outer, value);
+        break;
+      default:
+        errx(EXIT_FAILURE, "Invalid veth option '%s'", value);
+    }
+}
+
+void startnet(void) {
+  int address, index, sock;
+  struct nlmsghdr *header;
+  struct rtmsg *rtm;
+
+  sock = netlink();
+  linkup(1);
+
+  if (veth) {
+    if (!(index = if_nametoindex(name)))
+      err(EXIT_FAILURE, "Failed to find %s in container", name);
+    for (address = 0; address < ADDRESSES && inner[address].family; address++)
+      addaddress(index, inner + address);
+    linkup(index);
+
+    if (gateway.family) {
+      header = begin(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL);
+      rtm = put(sizeof(struct rtmsg));
+      rtm->rtm_family = gateway.family;
+      rtm->rtm_table = RT_TABLE_MAIN;
+      rtm->rtm_protocol = RTPROT_BOOT;
+      rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+      rtm->rtm_type = RTN_UNICAST;
+      attribute(RTA_GATEWAY, gateway.data,
+        gateway.family == AF_INET ? 4 : 16);
+      attribute(RTA_OIF, &index, sizeof(index));
+      end(header);
+    }
+  }
+
+  transact(sock, "configure container network");
+  close(sock);
+}
@@ -1,37 +1,328 @@
 #define _GNU_SOURCE
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
 #include "contain.h"
 
+#define REQUEST_MAX (1 << 24)
+
+struct request {
+  size_t args, envs, length;
+};
+
+static char *socketpath;
+
 static void usage(const char *progname) {
   fprintf(stderr, "\
 Usage: %s [OPTIONS] [CMD [ARG]...]\n\
+       %s -d SOCKET [OPTIONS]\n\
+       %s -s SOCKET [CMD [ARG]...]\n\
 Options:\n\
+  -d SOCKET serve commands sent with -s from one persistent namespace\n\
   -g MAP    set the user namespace GID map\n\
+  -s SOCKET run a command in the namespace of the pseudo -d at SOCKET\n\
   -u MAP    set the user namespace UID map\n\
 GID and UID maps are specified as START:LOWER:COUNT[,START:LOWER:COUNT]...\n\
-", progname);
+", progname, progname, progname);
   exit(EX_USAGE);
 }
 
+static void pack(char **data, size_t *length, char *item) {
+  size_t size = strlen(item) + 1;
+
+  if (!(*data = realloc(*data, *length + size)))
+    err(EXIT_FAILURE, "realloc");
+  memcpy(*data + *length, item, size);
+  *length += size;
+}
+
+static char **unpack(char **data, char *end, size_t count) {
+  char **list;
+  size_t index;
+
+  if (!(list = calloc(count + 1, sizeof(char *))))
+    err(EXIT_FAILURE, "calloc");
+  for (index = 0; index < count; index++) {
+    if (*data >= end)
+      errx(EXIT_FAILURE, "Malformed session request");
+    list[index] = *data;
+    *data += strlen(*data) + 1;
+  }
+  return list;
+}
+
+static void finished(int fd, int events, void *data) {
+  int status;
+
+  if (read(fd, &status, sizeof(status)) != sizeof(status))
+    *(int *) data = EXIT_FAILURE;
+  else if (WIFSIGNALED(status))
+    *(int *) data = 128 + WTERMSIG(status);
+  else
+    *(int *) data = WEXITSTATUS(status);
+  stoploop();
+}
+
+static void forward(int signal, void *data) {
+  if (send(*(int *) data, &signal, sizeof(signal), MSG_NOSIGNAL) < 0)
+    if (errno != EAGAIN && errno != EINTR)
+      stoploop();
+}
+
+static int attach(char *path, char **argv) {
+  char *data = NULL, *shell[] = { getenv("SHELL"), NULL };
+  int fds[4], sock, status = EXIT_FAILURE;
+  size_t offset;
+  ssize_t count;
+  struct request request = { 0 };
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+  if (strlen(path) >= sizeof(address.sun_path))
+    errx(EXIT_FAILURE, "Socket path %s is too long", path);
+  strcpy(address.sun_path, path);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    err(EXIT_FAILURE, "socket");
+  if (connect(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
+    err(EXIT_FAILURE, "connect %s", path);
+
+  if (!argv[0])
+    argv = shell[0] ? shell : (char *[]) { SHELL, NULL };
+  for (; argv[request.args]; request.args++)
+    pack(&data, &request.length, argv[request.args]);
+  for (; environ[request.envs]; request.envs++)
+    pack(&data, &request.length, environ[request.envs]);
+
+  /* The server runs the command with our stdio and working directory. */
+  fds[0] = STDIN_FILENO;
+  fds[1] = STDOUT_FILENO;
+  fds[2] = STDERR_FILENO;
+  if ((fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+    err(EXIT_FAILURE, "open working directory");
+
+  if (sendfds(sock, &request, sizeof(request), fds, 4) < 0)
+    err(EXIT_FAILURE, "sendmsg");
+  close(fds[3]);
+  for (offset = 0; offset < request.length; offset += count)
+    while ((count = write(sock, data + offset, request.length - offset)) < 0)
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "write");
+  free(data);
+
+  watchsignal(SIGHUP, forward, &sock);
+  watchsignal(SIGINT, forward, &sock);
+  watchsignal(SIGQUIT, forward, &sock);
+  watchsignal(SIGTERM, forward, &sock);
+  watchsignal(SIGUSR1, forward, &sock);
+  watchsignal(SIGUSR2, forward, &sock);
+  watchsignal(SIGWINCH, forward, &sock);
+  watchfd(sock, EPOLLIN, finished, &status);
+  runloop();
+  return status;
+}
+
+static void exited(pid_t pid, int status, void *data) {
+  send(*(int *) data, &status, sizeof(status), MSG_NOSIGNAL);
+  stoploop();
+}
+
+static void relay(int fd, int events, void *data) {
+  int signal;
+  ssize_t length;
+
+  if ((length = read(fd, &signal, sizeof(signal))) < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      err(EXIT_FAILURE, "read");
+    return;
+  }
+
+  /* A client that disconnects early is treated as a hangup. */
+  if (length != sizeof(signal)) {
+    unwatchfd(fd);
+    signal = SIGHUP;
+  }
+  if (signal > 0 && signal < NSIG)
+    kill(-*(pid_t *) data, signal);
+}
+
+static void handle(int sock) {
+  char **args, *data, **envs, *item;
+  int fds[4], index;
+  pid_t child;
+  size_t offset;
+  ssize_t count;
+  struct request request;
+
+  count = recvfds(sock, &request, sizeof(request), fds, 4);
+  if (count != sizeof(request) || fds[3] < 0 || request.args == 0)
+    errx(EXIT_FAILURE, "Malformed session request");
+  if (request.length > REQUEST_MAX)
+    errx(EXIT_FAILURE, "Session request is too large");
+
+  if (!(data = malloc(request.length + 1)))
+    err(EXIT_FAILURE, "malloc");
+  for (offset = 0; offset < request.length; offset += count)
+    if ((count = read(sock, data + offset, request.length - offset)) <= 0) {
+      if (count == 0)
+        errx(EXIT_FAILURE, "Truncated session request");
+      if (errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "read");
+      count = 0;
+    }
+  data[request.length] = 0;
+
+  item = data;
+  args = unpack(&item, data + request.length, request.args);
+  envs = unpack(&item, data + request.length, request.envs);
+
+  switch (child = fork()) {
+    case -1:
+      err(EXIT_FAILURE, "fork");
+    case 0:
+      setpgid(0, 0);
+      if (fchdir(fds[3]) < 0)
+        err(EXIT_FAILURE, "fchdir");
+      for (index = 0; index < 3; index++)
+        if (dup2(fds[index], index) < 0)
+          err(EXIT_FAILURE, "dup2");
+      environ = envs;
+      execvp(args[0], args);
+      err(EXIT_FAILURE, "exec %s", args[0]);
+  }
+
+  setpgid(child, child);
+  for (index = 0; index < 4; index++)
+    if (fds[index] >= 0)
+      close(fds[index]);
+
+  watchpid(child, exited, &sock);
+  watchfd(sock, EPOLLIN, relay, &child);
+  runloop();
+}
+
+static void stop(int signal) {
+  unlink(socketpath);
+  _exit(EXIT_SUCCESS);
+}
+
+static int listensession(char *path) {
+  int sock;
+  mode_t mask;
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+  if (strlen(path) >= sizeof(address.sun_path))
+    errx(EXIT_FAILURE, "Socket path %s is too long", path);
+  strcpy(address.sun_path, path);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    err(EXIT_FAILURE, "socket");
+
+  /* Only the invoking user may connect, as checked again in admit(). */
+  mask = umask(0177);
+  if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
+    err(EXIT_FAILURE, "bind %s", path);
+  umask(mask);
+
+  if (listen(sock, SOMAXCONN) < 0)
+    err(EXIT_FAILURE, "listen");
+  socketpath = path;
+  return sock;
+}
+
+static void accepted(int fd, int events, void *data) {
+  int sock;
+  socklen_t size = sizeof(struct ucred);
+  struct ucred cred;
+
+  if ((sock = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+      err(EXIT_FAILURE, "accept");
+    return;
+  }
+
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) >= 0)
+    if (cred.uid == getuid())
+      if (sendfds(*(int *) data, "", 1, &sock, 1) < 0)
+        stop(SIGTERM);
+  close(sock);
+}
+
+static void orphaned(int fd, int events, void *data) {
+  stop(SIGTERM);
+}
+
+static void admit(int listener, int channel) {
+  /* This process stays in the host user namespace, where the peer UID can
+     be compared with ours whatever the maps of the session namespace, and
+     removes the socket once told to stop or once the server has gone. */
+  signal(SIGHUP, stop);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  watchfd(listener, EPOLLIN, accepted, &channel);
+  watchfd(channel, EPOLLIN, orphaned, NULL);
+  runloop();
+  exit(EXIT_SUCCESS);
+}
+
+static void serve(int channel) {
+  int sock;
+
+  signal(SIGCHLD, SIG_IGN);
+  while (recvfds(channel, (char [1]) { 0 }, 1, &sock, 1) > 0) {
+    if (sock < 0)
+      continue;
+
+    switch (fork()) {
+      case -1:
+        warn("fork");
+        break;
+      case 0:
+        close(channel);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        setsid();
+        handle(sock);
+        _exit(EXIT_SUCCESS);
+    }
+    close(sock);
+  }
+  exit(EXIT_SUCCESS);
+}
+
 int main(int argc, char **argv) {
-  char *gidmap = NULL, *uidmap = NULL;
-  int option;
+  char *gidmap = NULL, *server = NULL, *session = NULL, *uidmap = NULL;
+  int listener, option, sockets[2];
   pid_t child, parent;
 
-  while ((option = getopt(argc, argv, "+:g:u:")) > 0)
+  while ((option = getopt(argc, argv, "+:d:g:s:u:")) > 0)
     switch (option) {
+      case 'd':
+        server = optarg;
+        break;
       case 'g':
         gidmap = optarg;
         break;
+      case 's':
+        session = optarg;
+        break;
       case 'u':
         uidmap = optarg;
         break;
@@ -39,11 +330,25 @@ int main(int argc, char **argv) {
         usage(argv[0]);
     }
 
+  if (session) {
+    if (server || gidmap || uidmap)
+      usage(argv[0]);
+    if (setgid(getgid()) < 0 || setuid(getuid()) < 0)
+      errx(EXIT_FAILURE, "Failed to drop privileges");
+    return attach(session, argv + optind);
+  }
+
+  if (server && argv[optind])
+    usage(argv[0]);
+
   parent = getpid();
   switch (child = fork()) {
     case -1:
       err(EXIT_FAILURE, "fork");
     case 0:
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() != parent)
+        exit(EXIT_FAILURE);
       raise(SIGSTOP);
       if (geteuid() != 0)
         denysetgroups(parent);
@@ -56,6 +361,24 @@ int main(int argc, char **argv) {
     errx(EXIT_FAILURE, "Failed to drop privileges");
   prctl(PR_SET_DUMPABLE, 1);
 
+  /* The socket is bound with the credentials of the invoking user, and
+     connections are accepted by a child left behind in the host user
+     namespace, which passes them on to the server once vetted. */
+  if (server) {
+    listener = listensession(server);
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) < 0)
+      err(EXIT_FAILURE, "socketpair");
+    switch (fork()) {
+      case -1:
+        err(EXIT_FAILURE, "fork");
+      case 0:
+        close(sockets[0]);
+        admit(listener, sockets[1]);
+    }
+    close(listener);
+    close(sockets[1]);
+  }
+
   if (unshare(CLONE_NEWUSER) < 0)
     errx(EXIT_FAILURE, "Failed to unshare user namespace");
 
@@ -67,6 +390,9 @@ int main(int argc, char **argv) {
   setgroups(0, NULL);
   setuid(0);
 
+  if (server)
+    serve(sockets[0]);
+
   if (argv[optind])
     execvp(argv[optind], argv + optind);
   else if (getenv("SHELL"))
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/ioprio.h>
+#include <linux/mempolicy.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include "contain.h"
+
+#define BITS (sizeof(unsigned long) * CHAR_BIT)
+
+struct class {
+  char *name;
+  int policy, nice, ioclass, iolevel;
+  char *cpuweight, *ioweight;
+};
+
+static struct class classes[] = {
+  { "latency", SCHED_OTHER, 0, IOPRIO_CLASS_BE, 0, "1000", "1000" },
+  { "batch", SCHED_BATCH, 10, IOPRIO_CLASS_BE, 7, "50", "50" },
+  { "idle", SCHED_IDLE, 19, IOPRIO_CLASS_IDLE, 0, "1", "1" },
+  { NULL }
+};
+
+static char *cpulist, *nodelist;
+static struct class *class;
+static unsigned long cpus[CPU_SETSIZE / BITS], nodes[1024 / BITS];
+
+static int parsebits(char *text, unsigned long *mask, size_t size) {
+  char *end;
+  unsigned long first, last;
+
+  do {
+    first = last = strtoul(text, &end, 10);
+    if (end == text)
+      return -1;
+    if (*end == '-') {
+      text = end + 1;
+      last = strtoul(text, &end, 10);
+      if (end == text || last < first)
+        return -1;
+    }
+    if (last >= size * BITS)
+      return -1;
+    for (; first <= last; first++)
+      mask[first / BITS] |= 1UL << first % BITS;
+    text = end + 1;
+  } while (*end == ',');
+  return *end ? -1 : 0;
+}
+
+void setaffinity(char *spec) {
+  char *colon;
+
+  memset(cpus, 0, sizeof(cpus));
+  memset(nodes, 0, sizeof(nodes));
+  cpulist = nodelist = NULL;
+
+  if ((colon = strchr(spec, ':'))) {
+    *colon = 0;
+    nodelist = colon + 1;
+    if (parsebits(nodelist, nodes, sizeof(nodes) / sizeof(*nodes)) < 0)
+      errx(EXIT_FAILURE, "Invalid NUMA node list '%s'", nodelist);
+  }
+
+  if (*spec) {
+    cpulist = spec;
+    if (parsebits(cpulist, cpus, sizeof(cpus) / sizeof(*cpus)) < 0)
+      errx(EXIT_FAILURE, "Invalid CPU list '%s'", cpulist);
+  }
+}
+
+void setclass(char *name) {
+  for (class = classes; class->name; class++)
+    if (strcmp(class->name, name) == 0)
+      return;
+  errx(EXIT_FAILURE, "Unknown scheduling class '%s'", name);
+}
+
+void tunecgroup(void) {
+  /* The container cgroup only has these controllers when the supervisor
+     is in the root cgroup, but the placement and priority of the processes
+     themselves are already enforced by tuneprocess() regardless. */
+  if (cpulist)
+    setcgroup("cpuset.cpus", cpulist);
+  if (nodelist)
+    setcgroup("cpuset.mems", nodelist);
+
+  if (class) {
+    setcgroup("cpu.weight", class->cpuweight);
+    setcgroup("io.weight", class->ioweight);
+    if (class->policy == SCHED_IDLE)
+      setcgroup("cpu.idle", "1");
+  }
+}
+
+void tuneprocess(void) {
+  if (cpulist && sched_setaffinity(0, sizeof(cpus), (cpu_set_t *) cpus) < 0)
+    errx(EXIT_FAILURE, "Failed to set CPU affinity to %s", cpulist);
+
+  if (nodelist && syscall(__NR_set_mempolicy, MPOL_BIND, nodes,
+        sizeof(nodes) * CHAR_BIT + 1) < 0)
+    errx(EXIT_FAILURE, "Failed to bind memory to NUMA nodes %s", nodelist);
+
+  if (!class)
+    return;
+
+  if (sched_setscheduler(0, class->policy, &(struct sched_param) { 0 }) < 0)
+    errx(EXIT_FAILURE, "Failed to set %s scheduling policy", class->name);
+
+  /* This runs before privileges are dropped, so only ever lower priority
+     rather than letting a class undo a nice value set by the caller. */
+  errno = 0;
+  if (class->nice > getpriority(PRIO_PROCESS, 0) && errno == 0)
+    if (setpriority(PRIO_PROCESS, 0, class->nice) < 0)
+      errx(EXIT_FAILURE, "Failed to set %s nice value", class->name);
+
+  if (syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+        IOPRIO_PRIO_VALUE(class->ioclass, class->iolevel)) < 0)
+    errx(EXIT_FAILURE, "Failed to set %s I/O priority", class->name);
+}
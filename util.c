@@ -9,6 +9,8 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "contain.h"
@@ -35,6 +37,55 @@ char *append(char **destination, const char *format, ...) {
   return result;
 }
 
+int join(pid_t pid, char *type) {
+  char *path;
+  int fd, result = -1;
+
+  path = string("/proc/%u/ns/%s", pid, type);
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+    if ((result = syscall(__NR_setns, fd, 0)) < 0 && strcmp(type, "user") == 0)
+      errx(EXIT_FAILURE, "Failed to join user namespace");
+    close(fd);
+  } else if (errno != ENOENT) {
+    errx(EXIT_FAILURE, "PID %u does not belong to you", pid);
+  } else if (strcmp(type, "user") == 0) {
+    errx(EXIT_FAILURE, "PID %u not found or user namespace unavailable", pid);
+  }
+
+  free(path);
+  return result;
+}
+
+ssize_t recvfds(int sock, void *data, size_t size, int *fds, int count) {
+  char control[CMSG_SPACE(count * sizeof(int))];
+  int index;
+  ssize_t length;
+  struct cmsghdr *header;
+  struct iovec iov = { .iov_base = data, .iov_len = size };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control)
+  };
+
+  for (index = 0; index < count; index++)
+    fds[index] = -1;
+
+  while ((length = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
+    if (errno != EAGAIN && errno != EINTR)
+      return -1;
+
+  header = CMSG_FIRSTHDR(&msg);
+  if (header && header->cmsg_type == SCM_RIGHTS) {
+    index = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(header), (index < count ? index : count)
+      * sizeof(int));
+  }
+  return length;
+}
+
 void seal(char **argv, char **envp) {
   const int seals = F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
   int dst, src;
@@ -62,6 +113,31 @@ void seal(char **argv, char **envp) {
   err(EXIT_FAILURE, "fexecve");
 }
 
+int sendfds(int sock, void *data, size_t size, int *fds, int count) {
+  char control[CMSG_SPACE(count * sizeof(int))];
+  struct cmsghdr *header;
+  struct iovec iov = { .iov_base = data, .iov_len = size };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = count > 0 ? control : NULL,
+    .msg_controllen = count > 0 ? sizeof(control) : 0
+  };
+
+  if (count > 0) {
+    header = CMSG_FIRSTHDR(&msg);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+  }
+
+  while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+    if (errno != EAGAIN && errno != EINTR)
+      return -1;
+  return 0;
+}
+
 char *string(const char *format, ...) {
   char *result;
   va_list args;